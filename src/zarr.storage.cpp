@@ -3,9 +3,23 @@
 
 #include <nlohmann/json.hpp>
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
 #include <filesystem>
+#include <fstream>
 #include <stdexcept>
 
+#ifdef __linux__
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #define LOG(...) aq_logger(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
 #define LOGE(...) aq_logger(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
 #define EXPECT(e, ...)                                                         \
@@ -128,6 +142,411 @@ split_uri(const std::string& uri)
     return out;
 }
 
+/// Key of the object in the external metadata that holds settings for this
+/// driver. The object itself is not written to the store.
+constexpr char driver_settings_key[] = "acquire-driver-zarr";
+
+/// Upper bound on the bytes of image data packed into one call to
+/// ZarrStream_append, or into one entry of the ingest queue.
+constexpr size_t max_batch_bytes = 16 << 20;
+
+/// Upper bound on "sync_interval_s": one day.
+constexpr size_t max_sync_interval_s = 24 * 60 * 60;
+
+/**
+ * @brief Split the driver settings out of the external metadata.
+ * @param metadata JSON-formatted external metadata.
+ * @param[out] stream_metadata @p metadata without the driver settings.
+ * @return The driver settings object, or an empty object if there is none.
+ */
+json
+extract_driver_settings(const std::string& metadata,
+                        std::string& stream_metadata)
+{
+    stream_metadata = metadata;
+
+    json parsed = json::parse(metadata,
+                              nullptr, // callback
+                              true,    // allow exceptions
+                              true     // ignore comments
+    );
+    if (!parsed.is_object() || !parsed.contains(driver_settings_key)) {
+        return json::object();
+    }
+
+    json settings = parsed[driver_settings_key];
+    EXPECT(settings.is_object(),
+           "Expected \"%s\" in external metadata to be an object.",
+           driver_settings_key);
+
+    parsed.erase(driver_settings_key);
+    stream_metadata = parsed.dump();
+
+    return settings;
+}
+
+/**
+ * @brief Get a non-negative integer value from the driver settings.
+ * @param settings Driver settings object.
+ * @param key Name of the setting.
+ * @param default_value Value to use if the setting is absent.
+ * @return The value of the setting.
+ */
+size_t
+get_size_setting(const json& settings, const char* key, size_t default_value)
+{
+    if (!settings.contains(key)) {
+        return default_value;
+    }
+
+    const auto& value = settings[key];
+    EXPECT(value.is_number_unsigned(),
+           "Expected setting \"%s\" to be a non-negative integer.",
+           key);
+
+    return value.get<size_t>();
+}
+
+/**
+ * @brief Get a boolean value from the driver settings.
+ * @param settings Driver settings object.
+ * @param key Name of the setting.
+ * @param default_value Value to use if the setting is absent.
+ * @return The value of the setting.
+ */
+bool
+get_bool_setting(const json& settings, const char* key, bool default_value)
+{
+    if (!settings.contains(key)) {
+        return default_value;
+    }
+
+    const auto& value = settings[key];
+    EXPECT(value.is_boolean(), "Expected setting \"%s\" to be a boolean.", key);
+
+    return value.get<bool>();
+}
+
+/**
+ * @brief Override compression settings with those in the driver settings.
+ * @details Compression settings are given as an object under "compression",
+ * with any of the keys "codec" ("none", "lz4", or "zstd"), "level" (0-9), and
+ * "shuffle" (0 for none, 1 for byte shuffle, 2 for bit shuffle). Absent keys
+ * leave the corresponding value unchanged, except that turning compression on
+ * defaults to level 1 and byte shuffle, as on the compressed devices.
+ * @param settings Driver settings object.
+ * @param[in, out] codec Compression codec.
+ * @param[in, out] level Compression level.
+ * @param[in, out] shuffle Shuffle mode.
+ */
+void
+get_compression_settings(const json& settings,
+                         ZarrCompressionCodec& codec,
+                         uint8_t& level,
+                         uint8_t& shuffle)
+{
+    if (!settings.contains("compression")) {
+        return;
+    }
+
+    const auto& compression = settings["compression"];
+    EXPECT(compression.is_object(),
+           "Expected setting \"compression\" to be an object.");
+
+    if (compression.contains("codec")) {
+        const auto& value = compression["codec"];
+        EXPECT(value.is_string(),
+               "Expected compression codec to be one of \"none\", \"lz4\", "
+               "or \"zstd\".");
+
+        ZarrCompressionCodec compression_codec;
+        const auto name = value.get<std::string>();
+        if (name == "none") {
+            compression_codec = ZarrCompressionCodec_None;
+        } else if (name == "lz4") {
+            compression_codec = ZarrCompressionCodec_BloscLZ4;
+        } else if (name == "zstd") {
+            compression_codec = ZarrCompressionCodec_BloscZstd;
+        } else {
+            throw std::runtime_error("Unsupported compression codec: " + name);
+        }
+
+        // the uncompressed devices have level 0 and no shuffle, which would
+        // leave the chunks wrapped by Blosc but uncompressed
+        if (codec == ZarrCompressionCodec_None &&
+            compression_codec != ZarrCompressionCodec_None) {
+            level = 1;
+            shuffle = 1;
+        }
+        codec = compression_codec;
+    }
+
+    const size_t compression_level =
+      get_size_setting(compression, "level", level);
+    EXPECT(compression_level <= 9,
+           "Invalid compression level: %zu. Compression level must be in "
+           "[0, 9].",
+           compression_level);
+    level = (uint8_t)compression_level;
+
+    const size_t compression_shuffle =
+      get_size_setting(compression, "shuffle", shuffle);
+    EXPECT(compression_shuffle <= 2,
+           "Invalid shuffle value: %zu. Shuffle must be 0, 1, or 2.",
+           compression_shuffle);
+    shuffle = (uint8_t)compression_shuffle;
+}
+
+/**
+ * @brief Parse a CPU list in the format used by sysfs, e.g., "0-3,8,10-11".
+ * @param list The CPU list.
+ * @return The CPU indices in @p list.
+ */
+std::vector<int>
+parse_cpu_list(const std::string& list)
+{
+    std::vector<int> cpus;
+
+    size_t begin = 0;
+    while (begin < list.size()) {
+        size_t end = list.find(',', begin);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+
+        const std::string range = list.substr(begin, end - begin);
+        if (!range.empty()) {
+            const size_t dash = range.find('-');
+            const int first = std::stoi(range.substr(0, dash));
+            const int last = dash == std::string::npos
+                               ? first
+                               : std::stoi(range.substr(dash + 1));
+            EXPECT(first >= 0 && first <= last,
+                   "Invalid CPU range: %s",
+                   range.c_str());
+
+            for (auto cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        }
+
+        begin = end + 1;
+    }
+
+    return cpus;
+}
+
+/**
+ * @brief Get the CPUs that the stream's threads should run on from the driver
+ * settings.
+ * @details CPUs are given either explicitly, as a list of CPU indices under
+ * "cpu_set", or as a NUMA node under "numa_node".
+ * @param settings Driver settings object.
+ * @return CPU indices, or an empty vector if the threads may run anywhere.
+ */
+std::vector<int>
+get_cpu_set_setting(const json& settings)
+{
+    const bool has_cpu_set = settings.contains("cpu_set");
+    const bool has_numa_node = settings.contains("numa_node");
+    if (!has_cpu_set && !has_numa_node) {
+        return {};
+    }
+
+#ifndef __linux__
+    throw std::runtime_error("CPU affinity is only supported on Linux.");
+#endif
+
+    EXPECT(!(has_cpu_set && has_numa_node),
+           "Set at most one of \"cpu_set\" and \"numa_node\".");
+
+    std::vector<int> cpus;
+    if (has_cpu_set) {
+        const auto& cpu_set = settings["cpu_set"];
+        EXPECT(cpu_set.is_array(),
+               "Expected setting \"cpu_set\" to be an array of CPU indices.");
+
+        for (const auto& cpu : cpu_set) {
+            EXPECT(cpu.is_number_unsigned(),
+                   "Expected setting \"cpu_set\" to be an array of CPU "
+                   "indices.");
+
+            // check the range before narrowing, so large indices can't wrap
+            const auto index = cpu.get<uint64_t>();
+#ifdef __linux__
+            EXPECT(index < CPU_SETSIZE,
+                   "CPU index %llu is out of range.",
+                   (unsigned long long)index);
+#endif
+            cpus.push_back((int)index);
+        }
+    } else {
+        const size_t node = get_size_setting(settings, "numa_node", 0);
+        const std::string path =
+          "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+
+        std::ifstream f(path);
+        EXPECT(f.is_open(), "NUMA node %zu not found.", node);
+
+        std::string list;
+        std::getline(f, list);
+        cpus = parse_cpu_list(list);
+    }
+
+    EXPECT(!cpus.empty(), "CPU set is empty.");
+#ifdef __linux__
+    for (const auto cpu : cpus) {
+        EXPECT(cpu >= 0 && cpu < CPU_SETSIZE,
+               "CPU index %d is out of range.",
+               cpu);
+    }
+#endif
+
+    return cpus;
+}
+
+/**
+ * @brief Restrict the calling thread to a set of CPUs until this object goes
+ * out of scope. Threads spawned in the meantime inherit the restriction.
+ */
+class ScopedCpuAffinity
+{
+  public:
+    explicit ScopedCpuAffinity([[maybe_unused]] const std::vector<int>& cpus)
+    {
+#ifdef __linux__
+        if (cpus.empty()) {
+            return;
+        }
+
+        const pthread_t self = pthread_self();
+        EXPECT(0 == pthread_getaffinity_np(self, sizeof(previous_), &previous_),
+               "Failed to get the CPU affinity of the calling thread.");
+
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        for (const auto cpu : cpus) {
+            CPU_SET(cpu, &mask);
+        }
+        EXPECT(0 == pthread_setaffinity_np(self, sizeof(mask), &mask),
+               "Failed to set the CPU affinity of the calling thread.");
+        pinned_ = true;
+#endif
+    }
+
+    ~ScopedCpuAffinity()
+    {
+#ifdef __linux__
+        if (pinned_) {
+            pthread_setaffinity_np(
+              pthread_self(), sizeof(previous_), &previous_);
+        }
+#endif
+    }
+
+  private:
+#ifdef __linux__
+    bool pinned_ = false;
+    cpu_set_t previous_;
+#endif
+};
+
+/**
+ * @brief Get the prefix of the names that @p path is given when it is moved
+ * aside to be deleted.
+ * @param path Path to the directory to be deleted.
+ * @return The prefix, e.g., ".my_video.zarr.trash-".
+ */
+std::string
+trash_prefix(const fs::path& path)
+{
+    return "." + path.filename().string() + ".trash-";
+}
+
+/**
+ * @brief Get an unused path next to @p path to move it to before deleting it.
+ * @param path Path to the directory to be deleted.
+ * @return A hidden sibling path that does not yet exist.
+ */
+fs::path
+make_trash_path(fs::path path)
+{
+    if (!path.has_filename()) {
+        path = path.parent_path(); // trailing separator
+    }
+
+    const auto stamp =
+      std::chrono::system_clock::now().time_since_epoch().count();
+    const std::string prefix = trash_prefix(path) + std::to_string(stamp);
+
+    fs::path trash_path = path.parent_path() / prefix;
+    for (auto i = 1; fs::exists(trash_path); ++i) {
+        trash_path = path.parent_path() / (prefix + "-" + std::to_string(i));
+    }
+
+    return trash_path;
+}
+
+/**
+ * @brief Find the trash left next to @p path by earlier deletions that did
+ * not finish, e.g., because the device was destroyed first.
+ * @param path Path to a store.
+ * @return Paths previously returned by make_trash_path for @p path.
+ */
+std::vector<fs::path>
+find_trash_paths(fs::path path)
+{
+    if (!path.has_filename()) {
+        path = path.parent_path(); // trailing separator
+    }
+
+    fs::path parent_path = path.parent_path();
+    if (parent_path.empty()) {
+        parent_path = ".";
+    }
+
+    const std::string prefix = trash_prefix(path);
+
+    std::vector<fs::path> paths;
+    std::error_code ec;
+    for (auto it = fs::directory_iterator(parent_path, ec);
+         !ec && it != fs::directory_iterator();
+         it.increment(ec)) {
+        const auto filename = it->path().filename();
+        if (filename.string().starts_with(prefix) && it->is_directory(ec)) {
+            // same form as make_trash_path, so queued paths compare equal
+            paths.push_back(path.parent_path() / filename);
+        }
+    }
+
+    return paths;
+}
+
+/**
+ * @brief Lower the scheduling and I/O priority of the calling thread, so that
+ * it only runs when nothing else wants the CPU or the disk.
+ */
+void
+lower_thread_priority()
+{
+#ifdef __linux__
+    const auto tid = (id_t)syscall(SYS_gettid);
+    if (setpriority(PRIO_PROCESS, tid, 19) != 0) {
+        LOG("Failed to lower the priority of thread %d.", (int)tid);
+    }
+
+    constexpr int ioprio_who_process = 1;
+    constexpr int ioprio_class_idle = 3;
+    constexpr int ioprio_class_shift = 13;
+    if (syscall(SYS_ioprio_set,
+                ioprio_who_process,
+                tid,
+                ioprio_class_idle << ioprio_class_shift) != 0) {
+        LOG("Failed to lower the I/O priority of thread %d.", (int)tid);
+    }
+#endif
+}
+
 /// \brief Check that the StorageProperties are valid.
 /// \details Assumes either an empty or valid JSON metadata string and a
 /// filename string that points to a writable directory. \param props Storage
@@ -293,6 +712,62 @@ average_two_frames(VideoFrame* dst, const VideoFrame* src)
     }
 }
 
+/**
+ * @brief Check whether two image shapes describe the same pixel layout.
+ * @details Frames with the same layout can be handed to the stream together
+ * as a single contiguous block.
+ * @param a First image shape.
+ * @param b Second image shape.
+ * @return True if the dimensions, strides, and sample types all match.
+ */
+bool
+is_same_shape(const ImageShape& a, const ImageShape& b)
+{
+    return a.type == b.type && a.dims.channels == b.dims.channels &&
+           a.dims.width == b.dims.width && a.dims.height == b.dims.height &&
+           a.dims.planes == b.dims.planes &&
+           a.strides.channels == b.strides.channels &&
+           a.strides.width == b.strides.width &&
+           a.strides.height == b.strides.height &&
+           a.strides.planes == b.strides.planes;
+}
+
+/**
+ * @brief Get the frame following @p frame in a packed frame buffer.
+ * @param frame The current frame.
+ * @return Pointer to the next frame.
+ */
+const VideoFrame*
+next_frame(const VideoFrame* frame)
+{
+    const uint8_t* p = ((const uint8_t*)frame) + frame->bytes_of_frame;
+    return (const VideoFrame*)p;
+}
+
+/**
+ * @brief Copy the images of a run of frames into a contiguous buffer.
+ * @param first First frame of the run.
+ * @param last One past the last frame of the run.
+ * @param frame_count Number of frames in the run.
+ * @param bytes_of_frame Size of each image, in bytes.
+ * @param out Buffer to copy the images into. Resized to fit.
+ */
+void
+pack_frames(const VideoFrame* first,
+            const VideoFrame* last,
+            size_t frame_count,
+            size_t bytes_of_frame,
+            std::vector<uint8_t>& out)
+{
+    out.resize(frame_count * bytes_of_frame);
+
+    uint8_t* dst = out.data();
+    for (auto* f = first; f < last; f = next_frame(f)) {
+        memcpy(dst, f->data, bytes_of_frame);
+        dst += bytes_of_frame;
+    }
+}
+
 DeviceState
 zarr_set(Storage* self_, const StorageProperties* props) noexcept
 {
@@ -446,12 +921,26 @@ sink::Zarr::Zarr(ZarrVersion version,
   , version_(version)
   , store_path_()
   , custom_metadata_("{}")
+  , stream_metadata_("{}")
   , dtype_(ZarrDataType_uint8)
+  , default_compression_codec_(compression_codec)
+  , default_compression_level_(compression_level)
+  , default_compression_shuffle_(shuffle)
   , compression_codec_(compression_codec)
   , compression_level_(compression_level)
   , compression_shuffle_(shuffle)
   , multiscale_(false)
   , stream_(nullptr)
+  , batch_frames_(false)
+  , background_delete_(false)
+  , deleting_(false)
+  , stop_deleting_(false)
+  , max_queued_frames_(0)
+  , queued_frames_(0)
+  , stop_ingest_(false)
+  , durability_(Durability::None)
+  , sync_interval_(0)
+  , stop_syncing_(false)
 {
     Zarr_set_log_level(ZarrLogLevel_Error);
     EXPECT(
@@ -471,6 +960,14 @@ sink::Zarr::Zarr(ZarrVersion version,
 sink::Zarr::~Zarr()
 {
     stop();
+
+    if (trash_thread_.joinable()) {
+        {
+            std::unique_lock lock(trash_mutex_);
+            stop_deleting_ = true;
+        }
+        trash_thread_.join();
+    }
 }
 
 void
@@ -480,23 +977,86 @@ sink::Zarr::set(const StorageProperties* props)
            "Cannot set properties while running.");
     EXPECT(props, "StorageProperties is NULL.");
 
+    // everything is checked before any member is changed, so that a rejected
+    // configuration leaves the previous one in effect
+
     // check that the external metadata is valid
+    std::string custom_metadata = custom_metadata_;
     if (props->external_metadata_json.str) {
         validate_json(props->external_metadata_json.str,
                       props->external_metadata_json.nbytes);
 
-        custom_metadata_ = props->external_metadata_json.str;
+        custom_metadata = props->external_metadata_json.str;
     }
 
-    if (custom_metadata_.empty()) {
-        custom_metadata_ = "{}";
+    if (custom_metadata.empty()) {
+        custom_metadata = "{}";
     }
 
+    std::string stream_metadata;
+    const json settings =
+      extract_driver_settings(custom_metadata, stream_metadata);
+    const size_t max_queued_frames =
+      get_size_setting(settings, "max_queued_frames", 0);
+    const bool batch_frames = get_bool_setting(settings, "batch_frames", false);
+    const bool background_delete =
+      get_bool_setting(settings, "background_delete", false);
+    std::vector<int> cpu_set = get_cpu_set_setting(settings);
+
+    // start from this device's compression settings
+    ZarrCompressionCodec compression_codec = default_compression_codec_;
+    uint8_t compression_level = default_compression_level_;
+    uint8_t compression_shuffle = default_compression_shuffle_;
+    get_compression_settings(
+      settings, compression_codec, compression_level, compression_shuffle);
+
+    Durability durability = Durability::None;
+    if (settings.contains("durability")) {
+        const auto& value = settings["durability"];
+        EXPECT(value.is_string(),
+               "Expected setting \"durability\" to be a string.");
+
+        const auto mode = value.get<std::string>();
+        if (mode == "on_stop") {
+            durability = Durability::OnStop;
+        } else if (mode == "every_n_seconds") {
+            durability = Durability::Every;
+        } else if (mode == "on_shard_close") {
+            // shards are written and closed inside the stream
+            throw std::runtime_error(
+              "Durability mode \"on_shard_close\" is not supported.");
+        } else {
+            EXPECT(mode == "none", "Unknown durability mode: %s", mode.c_str());
+        }
+    }
+
+#ifndef __linux__
+    EXPECT(durability == Durability::None,
+           "Durability modes are only supported on Linux.");
+#endif
+
+    const size_t sync_interval_s =
+      get_size_setting(settings, "sync_interval_s", 5);
+    EXPECT(durability != Durability::Every || sync_interval_s > 0,
+           "Expected setting \"sync_interval_s\" to be positive.");
+    EXPECT(sync_interval_s <= max_sync_interval_s,
+           "Expected setting \"sync_interval_s\" to be at most %zu.",
+           max_sync_interval_s);
+    const std::chrono::seconds sync_interval(sync_interval_s);
+
     EXPECT(props->uri.str, "URI string is NULL.");
     EXPECT(props->uri.nbytes > 1, "URI string is empty.");
     std::string uri(props->uri.str, props->uri.nbytes - 1);
 
+    std::optional<std::string> s3_endpoint;
+    std::optional<std::string> s3_bucket_name;
+    std::optional<std::string> s3_access_key_id;
+    std::optional<std::string> s3_secret_access_key;
+    std::string store_path;
+
     if (is_web_uri(uri)) {
+        EXPECT(durability == Durability::None,
+               "Durability modes only apply to filesystem stores.");
         EXPECT(props->access_key_id.str, "Access key ID is NULL.");
         EXPECT(props->access_key_id.nbytes > 1, "Access key ID is empty.");
         EXPECT(props->secret_access_key.str, "Secret access key is NULL.");
@@ -506,28 +1066,20 @@ sink::Zarr::set(const StorageProperties* props)
         auto components = split_uri(uri);
         EXPECT(components.size() > 3, "Invalid URI: %s", uri.c_str());
 
-        s3_endpoint_ = components[0] + "//" + components[1];
-        s3_bucket_name_ = components[2];
-        s3_access_key_id_ = props->access_key_id.str;
-        s3_secret_access_key_ = props->secret_access_key.str;
+        s3_endpoint = components[0] + "//" + components[1];
+        s3_bucket_name = components[2];
+        s3_access_key_id = props->access_key_id.str;
+        s3_secret_access_key = props->secret_access_key.str;
 
-        store_path_ = components[3];
+        store_path = components[3];
         for (auto i = 4; i < components.size(); ++i) {
-            store_path_ += "/" + components[i];
+            store_path += "/" + components[i];
         }
     } else {
         if (uri.find("file://") != std::string::npos) {
             uri = uri.substr(7); // strlen("file://") == 7
         }
-        std::string store_path = uri;
-
-        if (fs::exists(store_path)) {
-            std::error_code ec;
-            EXPECT(fs::remove_all(store_path, ec),
-                   R"(Failed to remove folder for "%s": %s)",
-                   store_path.c_str(),
-                   ec.message().c_str());
-        }
+        store_path = uri;
 
         fs::path parent_path = fs::path(store_path).parent_path();
         if (parent_path.empty())
@@ -544,12 +1096,10 @@ sink::Zarr::set(const StorageProperties* props)
                          fs::perms::others_write)) != fs::perms::none,
                "Expected \"%s\" to have write permissions.",
                parent_path.c_str());
-
-        store_path_ = store_path;
     }
 
-    dimension_names_.clear();
-    dimensions_.clear();
+    std::vector<std::string> dimension_names;
+    std::vector<ZarrDimensionProperties> dimensions;
 
     for (auto i = 0; i < props->acquisition_dimensions.size; ++i) {
         const auto* dim = props->acquisition_dimensions.data + i;
@@ -574,14 +1124,69 @@ sink::Zarr::set(const StorageProperties* props)
                                          std::to_string(dim->kind));
         }
 
-        dimension_names_.emplace_back(dim->name.str);
-        dimensions_.push_back({ nullptr,
-                                type,
-                                dim->array_size_px,
-                                dim->chunk_size_px,
-                                dim->shard_size_chunks });
+        dimension_names.emplace_back(dim->name.str);
+        dimensions.push_back({ nullptr,
+                               type,
+                               dim->array_size_px,
+                               dim->chunk_size_px,
+                               dim->shard_size_chunks });
+    }
+
+    // clear the way for the new store
+    if (!s3_endpoint) {
+        if (background_delete) {
+            // pick up any deletions a previous device did not finish
+            for (const auto& trash_path : find_trash_paths(store_path)) {
+                delete_in_background(trash_path);
+            }
+        }
+
+        if (fs::exists(store_path) && background_delete) {
+            // renaming is atomic and frees up the path right away
+            const fs::path trash_path = make_trash_path(store_path);
+
+            std::error_code ec;
+            fs::rename(store_path, trash_path, ec);
+            EXPECT(!ec,
+                   R"(Failed to move folder "%s" to "%s": %s)",
+                   store_path.c_str(),
+                   trash_path.string().c_str(),
+                   ec.message().c_str());
+
+            delete_in_background(trash_path);
+        } else if (fs::exists(store_path)) {
+            std::error_code ec;
+            EXPECT(fs::remove_all(store_path, ec),
+                   R"(Failed to remove folder for "%s": %s)",
+                   store_path.c_str(),
+                   ec.message().c_str());
+        }
     }
 
+    custom_metadata_ = std::move(custom_metadata);
+    stream_metadata_ = std::move(stream_metadata);
+
+    max_queued_frames_ = max_queued_frames;
+    batch_frames_ = batch_frames;
+    background_delete_ = background_delete;
+    cpu_set_ = std::move(cpu_set);
+
+    compression_codec_ = compression_codec;
+    compression_level_ = compression_level;
+    compression_shuffle_ = compression_shuffle;
+
+    durability_ = durability;
+    sync_interval_ = sync_interval;
+
+    s3_endpoint_ = std::move(s3_endpoint);
+    s3_bucket_name_ = std::move(s3_bucket_name);
+    s3_access_key_id_ = std::move(s3_access_key_id);
+    s3_secret_access_key_ = std::move(s3_secret_access_key);
+    store_path_ = std::move(store_path);
+
+    dimension_names_ = std::move(dimension_names);
+    dimensions_ = std::move(dimensions);
+
     multiscale_ = props->enable_multiscale;
 
     state = DeviceState_Armed;
@@ -723,7 +1328,7 @@ sink::Zarr::start()
 
     ZarrStreamSettings stream_settings{
         .store_path = store_path_.c_str(),
-        .custom_metadata = custom_metadata_.c_str(),
+        .custom_metadata = stream_metadata_.c_str(),
         .s3_settings = nullptr,
         .compression_settings = nullptr,
         .dimensions = dimensions_.data(),
@@ -757,8 +1362,26 @@ sink::Zarr::start()
         stream_settings.compression_settings = &compression_settings;
     }
 
-    stream_ = ZarrStream_create(&stream_settings);
-    CHECK(stream_);
+    {
+        // the stream's thread pool and our ingest and sync threads inherit
+        // the CPU affinity, and buffers the stream touches on creation are
+        // placed on the memory node local to these CPUs
+        ScopedCpuAffinity affinity(cpu_set_);
+
+        stream_ = ZarrStream_create(&stream_settings);
+        CHECK(stream_);
+
+        if (max_queued_frames_ > 0) {
+            ingest_error_.clear();
+            stop_ingest_ = false;
+            ingest_thread_ = std::thread([this] { ingest_loop(); });
+        }
+
+        if (durability_ == Durability::Every) {
+            stop_syncing_ = false;
+            sync_thread_ = std::thread([this] { sync_loop(); });
+        }
+    }
 
     state = DeviceState_Running;
 }
@@ -770,8 +1393,29 @@ sink::Zarr::stop() noexcept
         // make a copy of current settings before destroying the stream
         state = DeviceState_Armed;
 
+        if (ingest_thread_.joinable()) {
+            // the thread drains the queue before it exits
+            join_ingest_thread();
+            free_buffers_.clear();
+
+            if (!ingest_error_.empty()) {
+                LOGE("Failed to write queued frames: %s",
+                     ingest_error_.c_str());
+            }
+        }
+
+        join_sync_thread();
+
         ZarrStream_destroy(stream_);
         stream_ = nullptr;
+
+        batch_.clear();
+        batch_.shrink_to_fit();
+
+        // the stream flushes its last chunks and metadata on destruction
+        if (durability_ != Durability::None) {
+            sync_store();
+        }
     }
 }
 
@@ -784,27 +1428,270 @@ sink::Zarr::append(const VideoFrame* frames, size_t nbytes)
         return nbytes;
     }
 
-    const VideoFrame* cur = nullptr;
     const auto* end = (const VideoFrame*)((uint8_t*)frames + nbytes);
-    auto next = [&]() -> const VideoFrame* {
-        const uint8_t* p = ((const uint8_t*)cur) + cur->bytes_of_frame;
-        return (const VideoFrame*)p;
-    };
 
-    for (cur = frames; cur < end; cur = next()) {
+    const VideoFrame* cur = frames;
+    while (cur < end) {
         const size_t bytes_of_frame = bytes_of_image(&cur->shape);
-        size_t bytes_written;
-        ZARR_OK(ZarrStream_append(
-          stream_, cur->data, bytes_of_frame, &bytes_written));
-        EXPECT(bytes_written == bytes_of_frame,
-               "Expected to write %zu bytes, but wrote %zu.",
-               bytes_of_frame,
-               bytes_written);
+
+        // gather the run of frames sharing this frame's shape, up to the
+        // batch size and, when queueing, the size of the queue
+        const VideoFrame* run_end = next_frame(cur);
+        size_t frames_in_run = 1;
+        while (run_end < end && is_same_shape(cur->shape, run_end->shape) &&
+               (frames_in_run + 1) * bytes_of_frame <= max_batch_bytes &&
+               (max_queued_frames_ == 0 ||
+                frames_in_run < max_queued_frames_)) {
+            run_end = next_frame(run_end);
+            ++frames_in_run;
+        }
+
+        if (max_queued_frames_ > 0) {
+            enqueue(cur, run_end, frames_in_run, bytes_of_frame);
+        } else if (frames_in_run == 1 || !batch_frames_) {
+            for (auto* f = cur; f < run_end; f = next_frame(f)) {
+                append_to_stream(f->data, bytes_of_frame);
+            }
+        } else {
+            // frame headers sit between the images in the runtime's buffer,
+            // so pack the images back to back and hand them over in one call
+            pack_frames(cur, run_end, frames_in_run, bytes_of_frame, batch_);
+            append_to_stream(batch_.data(), batch_.size());
+        }
+
+        cur = run_end;
     }
 
     return nbytes;
 }
 
+void
+sink::Zarr::append_to_stream(const uint8_t* data, size_t nbytes)
+{
+    size_t bytes_written;
+    ZARR_OK(ZarrStream_append(stream_, data, nbytes, &bytes_written));
+    EXPECT(bytes_written == nbytes,
+           "Expected to write %zu bytes, but wrote %zu.",
+           nbytes,
+           bytes_written);
+}
+
+void
+sink::Zarr::enqueue(const VideoFrame* first,
+                    const VideoFrame* last,
+                    size_t frame_count,
+                    size_t bytes_of_frame)
+{
+    IngestBatch batch{ .frame_count = frame_count };
+    {
+        std::unique_lock lock(ingest_mutex_);
+        if (!free_buffers_.empty()) {
+            batch.data = std::move(free_buffers_.back());
+            free_buffers_.pop_back();
+        }
+    }
+
+    // the runtime reclaims the frames as soon as we return, so take a copy
+    pack_frames(first, last, frame_count, bytes_of_frame, batch.data);
+
+    {
+        std::unique_lock lock(ingest_mutex_);
+
+        // only block when the queue is full; runs are never larger than
+        // the queue, so this always makes progress
+        space_cv_.wait(lock, [&] {
+            return !ingest_error_.empty() ||
+                   queued_frames_ + frame_count <= max_queued_frames_;
+        });
+        EXPECT(ingest_error_.empty(),
+               "Failed to write queued frames: %s",
+               ingest_error_.c_str());
+
+        queued_frames_ += frame_count;
+        ingest_queue_.push_back(std::move(batch));
+    }
+    ingest_cv_.notify_one();
+}
+
+void
+sink::Zarr::join_ingest_thread() noexcept
+{
+    if (!ingest_thread_.joinable()) {
+        return;
+    }
+
+    {
+        std::unique_lock lock(ingest_mutex_);
+        stop_ingest_ = true;
+    }
+    ingest_cv_.notify_all();
+    ingest_thread_.join();
+}
+
+void
+sink::Zarr::ingest_loop()
+{
+    while (true) {
+        IngestBatch batch;
+        {
+            std::unique_lock lock(ingest_mutex_);
+            ingest_cv_.wait(
+              lock, [this] { return stop_ingest_ || !ingest_queue_.empty(); });
+
+            // drain the queue before stopping
+            if (ingest_queue_.empty()) {
+                break;
+            }
+
+            batch = std::move(ingest_queue_.front());
+            ingest_queue_.pop_front();
+        }
+
+        std::string error;
+        try {
+            append_to_stream(batch.data.data(), batch.data.size());
+        } catch (const std::exception& exc) {
+            error = exc.what();
+        } catch (...) {
+            error = "(unknown)";
+        }
+
+        {
+            std::unique_lock lock(ingest_mutex_);
+            queued_frames_ -= batch.frame_count;
+
+            if (!error.empty() && ingest_error_.empty()) {
+                ingest_error_ = error;
+
+                // nothing else can be written, so drop what's left
+                for (auto& b : ingest_queue_) {
+                    queued_frames_ -= b.frame_count;
+                }
+                ingest_queue_.clear();
+            }
+
+            free_buffers_.push_back(std::move(batch.data));
+        }
+        space_cv_.notify_all();
+    }
+}
+
+void
+sink::Zarr::sync_store() const noexcept
+{
+#ifdef __linux__
+    // syncfs flushes every file on the store's filesystem in one call, which
+    // is far cheaper than an fsync for each chunk
+    const int fd = open(store_path_.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0 || syncfs(fd) != 0) {
+        LOGE(R"(Failed to sync "%s": %s)",
+             store_path_.c_str(),
+             strerror(errno));
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+#endif
+}
+
+void
+sink::Zarr::join_sync_thread() noexcept
+{
+    if (sync_thread_.joinable()) {
+        {
+            std::unique_lock lock(sync_mutex_);
+            stop_syncing_ = true;
+        }
+        sync_cv_.notify_all();
+        sync_thread_.join();
+    }
+}
+
+void
+sink::Zarr::sync_loop()
+{
+    std::unique_lock lock(sync_mutex_);
+    while (!sync_cv_.wait_for(
+      lock, sync_interval_, [this] { return stop_syncing_; })) {
+        lock.unlock();
+        sync_store();
+        lock.lock();
+    }
+}
+
+void
+sink::Zarr::delete_in_background(const fs::path& path)
+{
+    std::unique_lock lock(trash_mutex_);
+    if (std::find(trash_.begin(), trash_.end(), path) != trash_.end()) {
+        return; // already queued
+    }
+    trash_.push_back(path);
+
+    if (!deleting_) {
+        // the previous thread, if any, has emptied the trash and exited
+        if (trash_thread_.joinable()) {
+            trash_thread_.join();
+        }
+
+        deleting_ = true;
+        trash_thread_ = std::thread([this] { empty_trash(); });
+    }
+}
+
+void
+sink::Zarr::empty_trash()
+{
+    lower_thread_priority();
+
+    while (true) {
+        fs::path path;
+        {
+            std::unique_lock lock(trash_mutex_);
+            if (trash_.empty()) {
+                deleting_ = false;
+                return;
+            }
+            path = trash_.front();
+        }
+
+        // delete file by file so that we can give up if the device is
+        // destroyed before we're done
+        std::error_code ec;
+        for (auto it = fs::recursive_directory_iterator(path, ec);
+             !ec && it != fs::recursive_directory_iterator();
+             it.increment(ec)) {
+            if (!it->is_directory(ec)) {
+                fs::remove(it->path(), ec);
+            }
+
+            std::unique_lock lock(trash_mutex_);
+            if (stop_deleting_) {
+                for (const auto& p : trash_) {
+                    LOGE(R"(Did not finish deleting "%s".)",
+                         p.string().c_str());
+                }
+                trash_.clear();
+                deleting_ = false;
+                return;
+            }
+        }
+
+        if (!ec) {
+            fs::remove_all(path, ec);
+        }
+        if (ec) {
+            LOGE(R"(Failed to delete "%s": %s)",
+                 path.string().c_str(),
+                 ec.message().c_str());
+        }
+
+        std::unique_lock lock(trash_mutex_);
+        trash_.pop_front();
+    }
+}
+
 void
 sink::Zarr::reserve_image_shape(const ImageShape* shape)
 {
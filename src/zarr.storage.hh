@@ -4,9 +4,15 @@
 
 #include "acquire.zarr.h"
 
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
+#include <thread>
 #include <vector>
 
 namespace acquire::sink {
@@ -38,9 +44,16 @@ struct Zarr : public Storage
     std::optional<std::string> s3_secret_access_key_;
 
     std::string custom_metadata_;
+    std::string stream_metadata_; // custom metadata less driver settings
 
     ZarrDataType dtype_;
 
+    /// Compression settings this device was created with, which may be
+    /// overridden in the driver settings
+    const ZarrCompressionCodec default_compression_codec_;
+    const uint8_t default_compression_level_;
+    const uint8_t default_compression_shuffle_;
+
     ZarrCompressionCodec compression_codec_;
     uint8_t compression_level_;
     uint8_t compression_shuffle_;
@@ -50,6 +63,74 @@ struct Zarr : public Storage
 
     bool multiscale_;
 
+    /// CPUs to run the stream's threads on; empty if unrestricted
+    std::vector<int> cpu_set_;
+
     ZarrStream* stream_;
+
+    /// If true, runs of frames are packed into a staging buffer and handed to
+    /// the stream in one call. Off by default, since it costs a copy.
+    bool batch_frames_;
+    std::vector<uint8_t> batch_; // released on stop
+
+    /// If true, a pre-existing store is moved aside and deleted on a
+    /// low-priority thread rather than in `set`
+    bool background_delete_;
+    std::deque<std::filesystem::path> trash_;
+    bool deleting_;      // trash thread is running
+    bool stop_deleting_; // device is being destroyed
+    std::mutex trash_mutex_;
+    std::thread trash_thread_;
+
+    /// Asynchronous ingest. Frames are copied into a bounded queue and
+    /// written to the stream on a dedicated thread.
+    struct IngestBatch
+    {
+        std::vector<uint8_t> data;
+        size_t frame_count;
+    };
+
+    size_t max_queued_frames_; // 0 appends synchronously
+    size_t queued_frames_;
+    bool stop_ingest_;
+    std::string ingest_error_;
+
+    std::deque<IngestBatch> ingest_queue_;
+    std::vector<std::vector<uint8_t>> free_buffers_;
+
+    std::mutex ingest_mutex_;
+    std::condition_variable ingest_cv_; // wakes the ingest thread
+    std::condition_variable space_cv_;  // wakes appenders waiting for space
+    std::thread ingest_thread_;
+
+    /// When data written to a filesystem store is flushed to stable storage
+    enum class Durability
+    {
+        None,   // left to the operating system
+        OnStop, // once, after the stream is destroyed
+        Every,  // every sync_interval_, and after the stream is destroyed
+    };
+
+    Durability durability_;
+    std::chrono::seconds sync_interval_;
+    bool stop_syncing_;
+    std::mutex sync_mutex_;
+    std::condition_variable sync_cv_;
+    std::thread sync_thread_;
+
+    void append_to_stream(const uint8_t* data, size_t nbytes);
+    void enqueue(const VideoFrame* first,
+                 const VideoFrame* last,
+                 size_t frame_count,
+                 size_t bytes_of_frame);
+    void delete_in_background(const std::filesystem::path& path);
+    void empty_trash();
+
+    void join_ingest_thread() noexcept;
+    void ingest_loop();
+
+    void sync_store() const noexcept;
+    void join_sync_thread() noexcept;
+    void sync_loop();
 };
 } // namespace acquire::sink
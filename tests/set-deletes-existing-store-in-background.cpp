@@ -0,0 +1,196 @@
+/// @file set-deletes-existing-store-in-background.cpp
+/// @brief Test that with background deletion enabled, configuring a Zarr
+/// writer over an existing store moves the store out of the way immediately
+/// and deletes it afterward, along with any trash left by an earlier device.
+
+#include "platform.h" // lib
+#include "logger.h"
+#include "device/kit/driver.h"
+#include "device/hal/driver.h"
+#include "device/hal/storage.h"
+#include "device/props/storage.h"
+
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+#define containerof(P, T, F) ((T*)(((char*)(P)) - offsetof(T, F)))
+
+/// Helper for passing size static strings as function args.
+/// For a function: `f(char*,size_t)` use `f(SIZED("hello"))`.
+/// Expands to `f("hello",5)`.
+#define SIZED(str) str, sizeof(str) - 1
+
+#define L (aq_logger)
+#define LOG(...) L(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define ERR(...) L(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            char buf[1 << 8] = { 0 };                                          \
+            ERR(__VA_ARGS__);                                                  \
+            snprintf(buf, sizeof(buf) - 1, __VA_ARGS__);                       \
+            throw std::runtime_error(buf);                                     \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false: %s", #e)
+#define DEVOK(e) CHECK(Device_Ok == (e))
+#define OK(e) CHECK(AcquireStatus_Ok == (e))
+
+void
+reporter(int is_error,
+         const char* file,
+         int line,
+         const char* function,
+         const char* msg)
+{
+    fprintf(is_error ? stderr : stdout,
+            "%s%s(%d) - %s: %s\n",
+            is_error ? "ERROR " : "",
+            file,
+            line,
+            function,
+            msg);
+}
+
+typedef struct Driver* (*init_func_t)(void (*reporter)(int is_error,
+                                                       const char* file,
+                                                       int line,
+                                                       const char* function,
+                                                       const char* msg));
+
+struct Storage*
+get_zarr(lib* lib)
+{
+
+    CHECK(lib_open_by_name(lib, "acquire-driver-zarr"));
+
+    auto init = (init_func_t)lib_load(lib, "acquire_driver_init_v0");
+    auto driver = init(reporter);
+    CHECK(driver);
+
+    struct Storage* zarr = nullptr;
+    for (uint32_t i = 0; i < driver->device_count(driver); ++i) {
+        DeviceIdentifier id;
+        DEVOK(driver->describe(driver, &id, i));
+        std::string dev_name{ id.name };
+
+        if (id.kind == DeviceKind_Storage && dev_name == "Zarr") {
+            struct Device* device = nullptr;
+
+            DEVOK(driver_open_device(driver, i, &device));
+            zarr = containerof(device, struct Storage, device);
+            break;
+        }
+    }
+
+    return zarr;
+}
+
+void
+make_existing_store()
+{
+    const fs::path store_path(TEST ".zarr");
+    fs::create_directories(store_path / "0" / "0");
+
+    for (auto i = 0; i < 100; ++i) {
+        std::ofstream f(store_path / "0" / "0" / std::to_string(i));
+        f << i;
+    }
+}
+
+void
+make_abandoned_trash()
+{
+    const fs::path trash_path("." TEST ".zarr.trash-1");
+    fs::create_directories(trash_path / "0");
+
+    for (auto i = 0; i < 10; ++i) {
+        std::ofstream f(trash_path / "0" / std::to_string(i));
+        f << i;
+    }
+}
+
+size_t
+count_trash()
+{
+    const std::string prefix = "." TEST ".zarr.trash";
+
+    size_t count = 0;
+    for (const auto& entry : fs::directory_iterator(".")) {
+        if (entry.path().filename().string().starts_with(prefix)) {
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+void
+configure(struct Storage* zarr)
+{
+    struct StorageProperties props = { 0 };
+    storage_properties_init(
+      &props,
+      0,
+      SIZED(TEST ".zarr") + 1,
+      SIZED(R"({"acquire-driver-zarr":{"background_delete":true}})") + 1,
+      { 0 },
+      3);
+
+    CHECK(storage_properties_set_dimension(
+      &props, 2, SIZED("x") + 1, DimensionType_Space, 64, 64, 0));
+    CHECK(storage_properties_set_dimension(
+      &props, 1, SIZED("y") + 1, DimensionType_Space, 48, 48, 0));
+    CHECK(storage_properties_set_dimension(
+      &props, 0, SIZED("t") + 1, DimensionType_Time, 0, 1, 0));
+
+    CHECK(DeviceState_Armed == zarr->set(zarr, &props));
+
+    storage_properties_destroy(&props);
+}
+
+int
+main()
+{
+    logger_set_reporter(reporter);
+    lib lib{};
+
+    try {
+        struct Storage* zarr = get_zarr(&lib);
+        CHECK(zarr);
+
+        make_existing_store();
+        make_abandoned_trash();
+        CHECK(1 == count_trash());
+
+        configure(zarr);
+
+        // the store's path is free as soon as set returns
+        CHECK(!fs::exists(TEST ".zarr"));
+
+        // the old store is gone shortly after
+        for (auto i = 0; i < 100 && count_trash() > 0; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        CHECK(0 == count_trash());
+
+        zarr->destroy(zarr);
+        lib_close(&lib);
+        return 0;
+    } catch (std::exception& e) {
+        ERR("%s", e.what());
+    } catch (...) {
+        ERR("Unknown exception");
+    }
+
+    lib_close(&lib);
+    return 1;
+}
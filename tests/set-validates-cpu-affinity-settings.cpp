@@ -0,0 +1,189 @@
+/// @file set-validates-cpu-affinity-settings.cpp
+/// @brief Test that the "cpu_set" and "numa_node" driver settings are
+/// validated when the Zarr writer is configured.
+
+#include "platform.h" // lib
+#include "logger.h"
+#include "device/kit/driver.h"
+#include "device/hal/driver.h"
+#include "device/hal/storage.h"
+#include "device/props/storage.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+#include <vector>
+
+#define containerof(P, T, F) ((T*)(((char*)(P)) - offsetof(T, F)))
+
+/// Helper for passing size static strings as function args.
+/// For a function: `f(char*,size_t)` use `f(SIZED("hello"))`.
+/// Expands to `f("hello",5)`.
+#define SIZED(str) str, sizeof(str) - 1
+
+#define L (aq_logger)
+#define LOG(...) L(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define ERR(...) L(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            char buf[1 << 8] = { 0 };                                          \
+            ERR(__VA_ARGS__);                                                  \
+            snprintf(buf, sizeof(buf) - 1, __VA_ARGS__);                       \
+            throw std::runtime_error(buf);                                     \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false: %s", #e)
+#define DEVOK(e) CHECK(Device_Ok == (e))
+#define OK(e) CHECK(AcquireStatus_Ok == (e))
+
+void
+reporter(int is_error,
+         const char* file,
+         int line,
+         const char* function,
+         const char* msg)
+{
+    fprintf(is_error ? stderr : stdout,
+            "%s%s(%d) - %s: %s\n",
+            is_error ? "ERROR " : "",
+            file,
+            line,
+            function,
+            msg);
+}
+
+typedef struct Driver* (*init_func_t)(void (*reporter)(int is_error,
+                                                       const char* file,
+                                                       int line,
+                                                       const char* function,
+                                                       const char* msg));
+
+struct Storage*
+get_zarr(lib* lib)
+{
+
+    CHECK(lib_open_by_name(lib, "acquire-driver-zarr"));
+
+    auto init = (init_func_t)lib_load(lib, "acquire_driver_init_v0");
+    auto driver = init(reporter);
+    CHECK(driver);
+
+    struct Storage* zarr = nullptr;
+    for (uint32_t i = 0; i < driver->device_count(driver); ++i) {
+        DeviceIdentifier id;
+        DEVOK(driver->describe(driver, &id, i));
+        std::string dev_name{ id.name };
+
+        if (id.kind == DeviceKind_Storage && dev_name == "Zarr") {
+            struct Device* device = nullptr;
+
+            DEVOK(driver_open_device(driver, i, &device));
+            zarr = containerof(device, struct Storage, device);
+            break;
+        }
+    }
+
+    return zarr;
+}
+
+DeviceState
+configure(struct Storage* zarr, const std::string& settings)
+{
+    const std::string metadata =
+      R"({"acquire-driver-zarr":)" + settings + "}";
+
+    struct StorageProperties props = { 0 };
+    storage_properties_init(&props,
+                            0,
+                            SIZED(TEST ".zarr") + 1,
+                            metadata.c_str(),
+                            metadata.size() + 1,
+                            { 0 },
+                            3);
+
+    CHECK(storage_properties_set_dimension(
+      &props, 2, SIZED("x") + 1, DimensionType_Space, 64, 64, 0));
+    CHECK(storage_properties_set_dimension(
+      &props, 1, SIZED("y") + 1, DimensionType_Space, 48, 48, 0));
+    CHECK(storage_properties_set_dimension(
+      &props, 0, SIZED("t") + 1, DimensionType_Time, 0, 1, 0));
+
+    const DeviceState state = zarr->set(zarr, &props);
+
+    storage_properties_destroy(&props);
+
+    return state;
+}
+
+void
+expect_rejected(struct Storage* zarr, const std::string& settings)
+{
+    EXPECT(DeviceState_Armed != configure(zarr, settings),
+           "Expected settings to be rejected: %s",
+           settings.c_str());
+}
+
+void
+expect_configured_with(struct Storage* zarr, const std::string& settings)
+{
+    const std::string expected =
+      R"({"acquire-driver-zarr":)" + settings + "}";
+
+    struct StorageProperties props = { 0 };
+    zarr->get(zarr, &props);
+
+    CHECK(props.external_metadata_json.str);
+    EXPECT(expected == props.external_metadata_json.str,
+           "Expected external metadata %s, got %s",
+           expected.c_str(),
+           props.external_metadata_json.str);
+
+    storage_properties_destroy(&props);
+}
+
+int
+main()
+{
+    logger_set_reporter(reporter);
+    lib lib{};
+
+    try {
+        struct Storage* zarr = get_zarr(&lib);
+        CHECK(zarr);
+
+#ifdef __linux__
+        const std::string accepted = R"({"cpu_set":[0]})";
+#else
+        // CPU affinity is only supported on Linux
+        expect_rejected(zarr, R"({"cpu_set":[0]})");
+
+        const std::string accepted = "{}";
+#endif
+        CHECK(DeviceState_Armed == configure(zarr, accepted));
+
+        expect_rejected(zarr, R"({"cpu_set":[0],"numa_node":0})");
+        expect_rejected(zarr, R"({"cpu_set":[]})");
+        expect_rejected(zarr, R"({"cpu_set":0})");
+        expect_rejected(zarr, R"({"cpu_set":[-1]})");
+        expect_rejected(zarr, R"({"cpu_set":[2147483648]})");
+        expect_rejected(zarr, R"({"cpu_set":[4294967296]})");
+        expect_rejected(zarr, R"({"numa_node":-1})");
+        expect_rejected(zarr, R"({"numa_node":1048576})");
+
+        // a rejected configuration leaves the previous one in effect
+        CHECK(DeviceState_Armed == zarr->state);
+        expect_configured_with(zarr, accepted);
+
+        lib_close(&lib);
+        return 0;
+    } catch (std::exception& e) {
+        ERR("%s", e.what());
+    } catch (...) {
+        ERR("Unknown exception");
+    }
+
+    lib_close(&lib);
+    return 1;
+}
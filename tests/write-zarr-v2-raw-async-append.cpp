@@ -0,0 +1,216 @@
+/// @file write-zarr-v2-raw-async-append.cpp
+/// @brief Test that frames queued for asynchronous writing are all written
+/// when the acquisition stops, and that the driver settings are not written
+/// to the store.
+
+#include "acquire.h"
+#include "device/hal/device.manager.h"
+#include "platform.h"
+#include "logger.h"
+
+#include <cstring>
+#include <fstream>
+#include <filesystem>
+#include <stdexcept>
+
+#include "nlohmann/json.hpp"
+
+namespace fs = std::filesystem;
+using json = nlohmann::json;
+
+void
+reporter(int is_error,
+         const char* file,
+         int line,
+         const char* function,
+         const char* msg)
+{
+    fprintf(is_error ? stderr : stdout,
+            "%s%s(%d) - %s: %s\n",
+            is_error ? "ERROR " : "",
+            file,
+            line,
+            function,
+            msg);
+}
+
+/// Helper for passing size static strings as function args.
+/// For a function: `f(char*,size_t)` use `f(SIZED("hello"))`.
+/// Expands to `f("hello",5)`.
+#define SIZED(str) str, sizeof(str) - 1
+
+#define L (aq_logger)
+#define LOG(...) L(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define ERR(...) L(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            char buf[1 << 8] = { 0 };                                          \
+            ERR(__VA_ARGS__);                                                  \
+            snprintf(buf, sizeof(buf) - 1, __VA_ARGS__);                       \
+            throw std::runtime_error(buf);                                     \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false: %s", #e)
+#define DEVOK(e) CHECK(Device_Ok == (e))
+#define OK(e) CHECK(AcquireStatus_Ok == (e))
+
+/// example: `ASSERT_EQ(int,"%d",42,meaning_of_life())`
+#define ASSERT_EQ(T, fmt, a, b)                                                \
+    do {                                                                       \
+        T a_ = (T)(a);                                                         \
+        T b_ = (T)(b);                                                         \
+        EXPECT(a_ == b_, "Expected %s==%s but " fmt "!=" fmt, #a, #b, a_, b_); \
+    } while (0)
+
+/// Check that a>b
+/// example: `ASSERT_GT(int,"%d",43,meaning_of_life())`
+#define ASSERT_GT(T, fmt, a, b)                                                \
+    do {                                                                       \
+        T a_ = (T)(a);                                                         \
+        T b_ = (T)(b);                                                         \
+        EXPECT(                                                                \
+          a_ > b_, "Expected (%s) > (%s) but " fmt "<=" fmt, #a, #b, a_, b_);  \
+    } while (0)
+
+static const uint32_t frame_width = 64;
+static const uint32_t frame_height = 48;
+static const uint32_t frames_per_chunk = 32;
+static const uint32_t chunk_count = 3;
+
+void
+acquire(AcquireRuntime* runtime, const char* filename)
+{
+    auto dm = acquire_device_manager(runtime);
+    CHECK(runtime);
+    CHECK(dm);
+
+    AcquireProperties props = {};
+    OK(acquire_get_configuration(runtime, &props));
+
+    DEVOK(device_manager_select(dm,
+                                DeviceKind_Camera,
+                                SIZED("simulated.*empty.*"),
+                                &props.video[0].camera.identifier));
+    DEVOK(device_manager_select(dm,
+                                DeviceKind_Storage,
+                                SIZED("Zarr"),
+                                &props.video[0].storage.identifier));
+
+    const char external_metadata[] =
+      R"({"hello":"world","acquire-driver-zarr":{"max_queued_frames":8}})";
+    const struct PixelScale sample_spacing_um = { 1, 1 };
+
+    CHECK(storage_properties_init(&props.video[0].storage.settings,
+                                  0,
+                                  (char*)filename,
+                                  strlen(filename) + 1,
+                                  (char*)external_metadata,
+                                  sizeof(external_metadata),
+                                  sample_spacing_um,
+                                  4));
+
+    CHECK(storage_properties_set_dimension(&props.video[0].storage.settings,
+                                           0,
+                                           SIZED("t") + 1,
+                                           DimensionType_Time,
+                                           0,
+                                           frames_per_chunk,
+                                           0));
+    CHECK(storage_properties_set_dimension(&props.video[0].storage.settings,
+                                           1,
+                                           SIZED("c") + 1,
+                                           DimensionType_Channel,
+                                           1,
+                                           1,
+                                           0));
+    CHECK(storage_properties_set_dimension(&props.video[0].storage.settings,
+                                           2,
+                                           SIZED("y") + 1,
+                                           DimensionType_Space,
+                                           frame_height,
+                                           frame_height,
+                                           0));
+    CHECK(storage_properties_set_dimension(&props.video[0].storage.settings,
+                                           3,
+                                           SIZED("x") + 1,
+                                           DimensionType_Space,
+                                           frame_width,
+                                           frame_width,
+                                           0));
+
+    props.video[0].camera.settings.binning = 1;
+    props.video[0].camera.settings.pixel_type = SampleType_u8;
+    props.video[0].camera.settings.shape = { .x = frame_width,
+                                             .y = frame_height };
+    // we may drop frames with lower exposure
+    props.video[0].camera.settings.exposure_time_us = 1e4;
+    props.video[0].max_frame_count = chunk_count * frames_per_chunk;
+
+    OK(acquire_configure(runtime, &props));
+    OK(acquire_start(runtime));
+    OK(acquire_stop(runtime));
+
+    storage_properties_destroy(&props.video[0].storage.settings);
+}
+
+void
+validate()
+{
+    CHECK(fs::is_directory(TEST ".zarr"));
+
+    const auto external_metadata_path = fs::path(TEST ".zarr") / "acquire.json";
+    CHECK(fs::is_regular_file(external_metadata_path));
+
+    // driver settings are not part of the external metadata
+    {
+        std::ifstream f(external_metadata_path);
+        json external_metadata = json::parse(f);
+        CHECK(external_metadata == json::parse(R"({"hello":"world"})"));
+    }
+
+    const auto zarray_path = fs::path(TEST ".zarr") / "0" / ".zarray";
+    CHECK(fs::is_regular_file(zarray_path));
+    ASSERT_GT(int, "%d", fs::file_size(zarray_path), 0);
+
+    // check metadata
+    std::ifstream f(zarray_path);
+    json zarray = json::parse(f);
+
+    auto shape = zarray["shape"];
+    ASSERT_EQ(int, "%d", chunk_count * frames_per_chunk, shape[0]);
+    ASSERT_EQ(int, "%d", 1, shape[1]);
+    ASSERT_EQ(int, "%d", frame_height, shape[2]);
+    ASSERT_EQ(int, "%d", frame_width, shape[3]);
+
+    // check that every queued frame made it to a chunk
+    const auto chunk_size = frames_per_chunk * frame_height * frame_width;
+    for (auto t = 0; t < chunk_count; ++t) {
+        const auto chunk_file_path =
+          fs::path(TEST ".zarr/0") / std::to_string(t) / "0" / "0" / "0";
+        CHECK(fs::is_regular_file(chunk_file_path));
+        ASSERT_EQ(int, "%d", chunk_size, fs::file_size(chunk_file_path));
+    }
+}
+
+int
+main()
+{
+    int retval = 1;
+    auto runtime = acquire_init(reporter);
+
+    try {
+        acquire(runtime, TEST ".zarr");
+        validate();
+
+        retval = 0;
+        LOG("Done (OK)");
+    } catch (const std::exception& exc) {
+        ERR("Exception: %s", exc.what());
+    } catch (...) {
+        ERR("Unknown exception");
+    }
+
+    acquire_shutdown(runtime);
+    return retval;
+}
@@ -0,0 +1,233 @@
+/// @file write-zarr-v2-raw-batched-append.cpp
+/// @brief Test that with batching enabled, several frames handed to the Zarr
+/// writer in a single append call are written in order, including when the
+/// run is longer than one batch.
+
+#include "platform.h" // lib
+#include "logger.h"
+#include "device/kit/driver.h"
+#include "device/hal/driver.h"
+#include "device/hal/storage.h"
+#include "device/props/storage.h"
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <stdexcept>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+#define containerof(P, T, F) ((T*)(((char*)(P)) - offsetof(T, F)))
+
+/// Helper for passing size static strings as function args.
+/// For a function: `f(char*,size_t)` use `f(SIZED("hello"))`.
+/// Expands to `f("hello",5)`.
+#define SIZED(str) str, sizeof(str) - 1
+
+#define L (aq_logger)
+#define LOG(...) L(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define ERR(...) L(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            char buf[1 << 8] = { 0 };                                          \
+            ERR(__VA_ARGS__);                                                  \
+            snprintf(buf, sizeof(buf) - 1, __VA_ARGS__);                       \
+            throw std::runtime_error(buf);                                     \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false: %s", #e)
+#define DEVOK(e) CHECK(Device_Ok == (e))
+#define OK(e) CHECK(AcquireStatus_Ok == (e))
+
+void
+reporter(int is_error,
+         const char* file,
+         int line,
+         const char* function,
+         const char* msg)
+{
+    fprintf(is_error ? stderr : stdout,
+            "%s%s(%d) - %s: %s\n",
+            is_error ? "ERROR " : "",
+            file,
+            line,
+            function,
+            msg);
+}
+
+typedef struct Driver* (*init_func_t)(void (*reporter)(int is_error,
+                                                       const char* file,
+                                                       int line,
+                                                       const char* function,
+                                                       const char* msg));
+
+struct Storage*
+get_zarr(lib* lib)
+{
+
+    CHECK(lib_open_by_name(lib, "acquire-driver-zarr"));
+
+    auto init = (init_func_t)lib_load(lib, "acquire_driver_init_v0");
+    auto driver = init(reporter);
+    CHECK(driver);
+
+    struct Storage* zarr = nullptr;
+    for (uint32_t i = 0; i < driver->device_count(driver); ++i) {
+        DeviceIdentifier id;
+        DEVOK(driver->describe(driver, &id, i));
+        std::string dev_name{ id.name };
+
+        if (id.kind == DeviceKind_Storage && dev_name == "Zarr") {
+            struct Device* device = nullptr;
+
+            DEVOK(driver_open_device(driver, i, &device));
+            zarr = containerof(device, struct Storage, device);
+            break;
+        }
+    }
+
+    return zarr;
+}
+
+// 2 MiB frames, so that a chunk's worth of frames (24 MiB) is split across
+// two batches of at most 16 MiB
+static const uint32_t frame_width = 2048;
+static const uint32_t frame_height = 1024;
+static const uint32_t frames_per_chunk = 12;
+
+void
+configure(struct Storage* zarr)
+{
+    struct StorageProperties props = { 0 };
+    storage_properties_init(
+      &props,
+      0,
+      SIZED(TEST ".zarr") + 1,
+      SIZED(R"({"acquire-driver-zarr":{"batch_frames":true}})") + 1,
+      { 0 },
+      3);
+
+    CHECK(storage_properties_set_dimension(&props,
+                                           0,
+                                           SIZED("t") + 1,
+                                           DimensionType_Time,
+                                           0,
+                                           frames_per_chunk,
+                                           0));
+    CHECK(storage_properties_set_dimension(&props,
+                                           1,
+                                           SIZED("y") + 1,
+                                           DimensionType_Space,
+                                           frame_height,
+                                           frame_height,
+                                           0));
+    CHECK(storage_properties_set_dimension(&props,
+                                           2,
+                                           SIZED("x") + 1,
+                                           DimensionType_Space,
+                                           frame_width,
+                                           frame_width,
+                                           0));
+
+    CHECK(DeviceState_Armed == zarr->set(zarr, &props));
+
+    storage_properties_destroy(&props);
+}
+
+void
+write_frames(struct Storage* zarr)
+{
+    struct ImageShape shape = {
+        .dims = {
+          .channels = 1,
+          .width = frame_width,
+          .height = frame_height,
+          .planes = 1,
+        },
+        .strides = {
+          .channels = 1,
+          .width = 1,
+          .height = frame_width,
+          .planes = frame_width * frame_height
+        },
+        .type = SampleType_u8,
+    };
+    zarr->reserve_image_shape(zarr, &shape);
+    CHECK(DeviceState_Running == zarr->start(zarr));
+
+    // pack a full chunk's worth of frames into one buffer, each frame filled
+    // with its own index
+    const size_t bytes_of_image = frame_width * frame_height;
+    const size_t bytes_of_frame = sizeof(VideoFrame) + bytes_of_image;
+    std::vector<uint8_t> buf(frames_per_chunk * bytes_of_frame);
+
+    for (auto i = 0; i < frames_per_chunk; ++i) {
+        auto* frame = (struct VideoFrame*)(buf.data() + i * bytes_of_frame);
+        frame->bytes_of_frame = bytes_of_frame;
+        frame->shape = shape;
+        frame->frame_id = i;
+        frame->hardware_frame_id = i;
+        frame->timestamps = { 0, 0 };
+        memset(frame->data, i, bytes_of_image);
+    }
+
+    size_t nbytes{ buf.size() };
+    CHECK(DeviceState_Running ==
+          zarr->append(zarr, (struct VideoFrame*)buf.data(), &nbytes));
+    CHECK(nbytes == buf.size());
+
+    CHECK(DeviceState_Armed == zarr->stop(zarr));
+}
+
+void
+validate()
+{
+    const auto chunk_file_path = fs::path(TEST ".zarr/0/0/0/0");
+    CHECK(fs::is_regular_file(chunk_file_path));
+
+    const size_t bytes_of_image = frame_width * frame_height;
+    CHECK(fs::file_size(chunk_file_path) == frames_per_chunk * bytes_of_image);
+
+    std::vector<uint8_t> chunk(frames_per_chunk * bytes_of_image);
+    std::ifstream f(chunk_file_path, std::ios::binary);
+    f.read((char*)chunk.data(), (std::streamsize)chunk.size());
+    CHECK(f.good());
+
+    for (auto i = 0; i < chunk.size(); ++i) {
+        EXPECT(chunk[i] == i / bytes_of_image,
+               "Expected %zu at byte %d, got %d",
+               i / bytes_of_image,
+               i,
+               chunk[i]);
+    }
+}
+
+int
+main()
+{
+    logger_set_reporter(reporter);
+    lib lib{};
+
+    try {
+        struct Storage* zarr = get_zarr(&lib);
+        CHECK(zarr);
+
+        configure(zarr);
+        write_frames(zarr);
+        validate();
+
+        lib_close(&lib);
+        return 0;
+    } catch (std::exception& e) {
+        ERR("%s", e.what());
+    } catch (...) {
+        ERR("Unknown exception");
+    }
+
+    lib_close(&lib);
+    return 1;
+}
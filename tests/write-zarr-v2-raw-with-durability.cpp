@@ -0,0 +1,230 @@
+/// @file write-zarr-v2-raw-with-durability.cpp
+/// @brief Test that the "durability" driver setting is validated when the
+/// Zarr writer is configured, and that a writer flushing its store on stop
+/// completes an acquisition.
+
+#include "platform.h" // lib
+#include "logger.h"
+#include "device/kit/driver.h"
+#include "device/hal/driver.h"
+#include "device/hal/storage.h"
+#include "device/props/storage.h"
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <stdexcept>
+#include <vector>
+
+#define containerof(P, T, F) ((T*)(((char*)(P)) - offsetof(T, F)))
+
+/// Helper for passing size static strings as function args.
+/// For a function: `f(char*,size_t)` use `f(SIZED("hello"))`.
+/// Expands to `f("hello",5)`.
+#define SIZED(str) str, sizeof(str) - 1
+
+#define L (aq_logger)
+#define LOG(...) L(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define ERR(...) L(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            char buf[1 << 8] = { 0 };                                          \
+            ERR(__VA_ARGS__);                                                  \
+            snprintf(buf, sizeof(buf) - 1, __VA_ARGS__);                       \
+            throw std::runtime_error(buf);                                     \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false: %s", #e)
+#define DEVOK(e) CHECK(Device_Ok == (e))
+#define OK(e) CHECK(AcquireStatus_Ok == (e))
+
+void
+reporter(int is_error,
+         const char* file,
+         int line,
+         const char* function,
+         const char* msg)
+{
+    fprintf(is_error ? stderr : stdout,
+            "%s%s(%d) - %s: %s\n",
+            is_error ? "ERROR " : "",
+            file,
+            line,
+            function,
+            msg);
+}
+
+typedef struct Driver* (*init_func_t)(void (*reporter)(int is_error,
+                                                       const char* file,
+                                                       int line,
+                                                       const char* function,
+                                                       const char* msg));
+
+struct Storage*
+get_zarr(lib* lib)
+{
+
+    CHECK(lib_open_by_name(lib, "acquire-driver-zarr"));
+
+    auto init = (init_func_t)lib_load(lib, "acquire_driver_init_v0");
+    auto driver = init(reporter);
+    CHECK(driver);
+
+    struct Storage* zarr = nullptr;
+    for (uint32_t i = 0; i < driver->device_count(driver); ++i) {
+        DeviceIdentifier id;
+        DEVOK(driver->describe(driver, &id, i));
+        std::string dev_name{ id.name };
+
+        if (id.kind == DeviceKind_Storage && dev_name == "Zarr") {
+            struct Device* device = nullptr;
+
+            DEVOK(driver_open_device(driver, i, &device));
+            zarr = containerof(device, struct Storage, device);
+            break;
+        }
+    }
+
+    return zarr;
+}
+
+namespace fs = std::filesystem;
+
+DeviceState
+configure(struct Storage* zarr, const char* uri, const std::string& settings)
+{
+    const std::string metadata =
+      R"({"acquire-driver-zarr":)" + settings + "}";
+
+    struct StorageProperties props = { 0 };
+    storage_properties_init(&props,
+                            0,
+                            uri,
+                            strlen(uri) + 1,
+                            metadata.c_str(),
+                            metadata.size() + 1,
+                            { 0 },
+                            3);
+
+    CHECK(storage_properties_set_dimension(
+      &props, 2, SIZED("x") + 1, DimensionType_Space, 64, 64, 0));
+    CHECK(storage_properties_set_dimension(
+      &props, 1, SIZED("y") + 1, DimensionType_Space, 48, 48, 0));
+    CHECK(storage_properties_set_dimension(
+      &props, 0, SIZED("t") + 1, DimensionType_Time, 0, 1, 0));
+
+    const DeviceState state = zarr->set(zarr, &props);
+
+    storage_properties_destroy(&props);
+
+    return state;
+}
+
+void
+expect_rejected(struct Storage* zarr,
+                const char* uri,
+                const std::string& settings)
+{
+    EXPECT(DeviceState_Armed != configure(zarr, uri, settings),
+           "Expected settings to be rejected: %s",
+           settings.c_str());
+}
+
+void
+start_write_stop(struct Storage* zarr)
+{
+    struct ImageShape shape = {
+        .dims = {
+          .channels = 1,
+          .width = 64,
+          .height = 48,
+          .planes = 1,
+        },
+        .strides = {
+          .channels = 1,
+          .width = 1,
+          .height = 64,
+          .planes = 64 * 48
+        },
+        .type = SampleType_u8,
+    };
+    zarr->reserve_image_shape(zarr, &shape);
+    CHECK(DeviceState_Running == zarr->start(zarr));
+
+    auto* frame = (struct VideoFrame*)malloc(sizeof(VideoFrame) + 64 * 48);
+    memset(frame, 0, sizeof(VideoFrame) + 64 * 48);
+    frame->bytes_of_frame = sizeof(*frame) + 64 * 48;
+    frame->shape = shape;
+
+    for (auto i = 0; i < 4; ++i) {
+        size_t nbytes{ frame->bytes_of_frame };
+        CHECK(DeviceState_Running == zarr->append(zarr, frame, &nbytes));
+        CHECK(nbytes == 64 * 48 + sizeof(*frame));
+    }
+
+    free(frame);
+
+    CHECK(DeviceState_Armed == zarr->stop(zarr));
+}
+
+int
+main()
+{
+    logger_set_reporter(reporter);
+    lib lib{};
+
+    try {
+        struct Storage* zarr = get_zarr(&lib);
+        CHECK(zarr);
+
+        const char* uri = TEST ".zarr";
+
+        expect_rejected(zarr, uri, R"({"durability":"sometimes"})");
+        expect_rejected(zarr, uri, R"({"durability":1})");
+        expect_rejected(zarr, uri, R"({"durability":"on_shard_close"})");
+        expect_rejected(
+          zarr, uri, R"({"durability":"every_n_seconds","sync_interval_s":0})");
+        expect_rejected(zarr,
+                        uri,
+                        R"({"durability":"every_n_seconds",)"
+                        R"("sync_interval_s":86401})");
+        expect_rejected(zarr,
+                        uri,
+                        R"({"durability":"every_n_seconds",)"
+                        R"("sync_interval_s":100000000000000000})");
+        expect_rejected(zarr,
+                        "http://localhost:9000/acquire-test/" TEST ".zarr",
+                        R"({"durability":"on_stop"})");
+
+#ifdef __linux__
+        CHECK(DeviceState_Armed ==
+              configure(zarr, uri, R"({"durability":"on_stop"})"));
+        start_write_stop(zarr);
+
+        CHECK(fs::is_regular_file(fs::path(uri) / "0" / ".zarray"));
+        CHECK(fs::is_regular_file(fs::path(uri) / "0" / "3" / "0" / "0"));
+
+        CHECK(DeviceState_Armed ==
+              configure(zarr,
+                        uri,
+                        R"({"durability":"every_n_seconds",)"
+                        R"("sync_interval_s":1})"));
+        start_write_stop(zarr);
+#else
+        // durability modes are only supported on Linux
+        expect_rejected(zarr, uri, R"({"durability":"on_stop"})");
+#endif
+
+        lib_close(&lib);
+        return 0;
+    } catch (std::exception& e) {
+        ERR("%s", e.what());
+    } catch (...) {
+        ERR("Unknown exception");
+    }
+
+    lib_close(&lib);
+    return 1;
+}